@@ -7,6 +7,7 @@ Copyright (c) 2021 - GROUiK/FRENCH TOUCH / Thomas Harte
 MIT License
 
 v0.31 - Custom 32 sectors/128 bytes - with GAPS custom (GAP1 = 8 / GAP2 = 7 / GAP3 = 8)
+v0.32 - Bulk mode: convert DSK/PO images to complete WOZ1/WOZ2 images on all cores
 
 Usage:
 W2W s d track sector image.woz binary.b [-v]
@@ -17,6 +18,15 @@ first [sector] number
 image.woz name
 binary.b name
 -v verbose mode (optional)
+
+Bulk mode:
+W2W -b 1|2 output_dir input [input ...]
+[1]: WOZ1 / [2]: WOZ2 output
+output_dir: directory where the .woz images are created
+input: a .dsk/.do/.po image (written as output_dir/name.woz)
+       a directory (searched recursively, its tree is mirrored under output_dir/directory_name)
+       @list.txt (one image or directory per line, no nested @list)
+.po images are read in ProDOS order, anything else in DOS order
 */
 
 #define _CRT_SECURE_NO_WARNINGS
@@ -27,14 +37,33 @@ binary.b name
 #include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
+#include <ctype.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
 
 // Forward declarations; see definitions for documentation.
 static uint32_t crc32(const uint8_t* buf, size_t size);
 static void serialise_sector_standard(uint8_t* dest, const uint8_t* src, size_t track_position, size_t sector, size_t track_number, bool bVerbose);
 static void serialise_sector_custom1(uint8_t* dest, const uint8_t* src, size_t track_position, size_t sector, size_t track_number, bool bVerbose);
+static int bulk_convert(int argc, char* argv[]);
 
 
 int main(int argc, char* argv[]) {
+	// Bulk conversion mode
+	if (argc >= 2 && ((strcmp(argv[1], "-b") == 0) || (strcmp(argv[1], "-B") == 0))) {
+		return bulk_convert(argc, argv);
+	}
+
 	// Announce failure if there are anything other than six arguments.
 	if (argc != 7 && argc !=8) {
 		// args#        0  1 2    3      4         5       6	   7
@@ -668,3 +697,522 @@ static void serialise_sector_custom1(uint8_t* dest, const uint8_t* src, size_t t
 	}
 	if (bVerbose) printf(" - %llu \n", track_position);
 }
+
+
+
+/*
+	Bulk conversion: builds complete WOZ1/WOZ2 images from scratch out of
+	DSK (DOS order) or PO (ProDOS order) images, as DSK2WOZ does.
+*/
+
+static const size_t dsk_image_size = 35 * 16 * 256;						// 143360 bytes
+static const size_t woz1_image_size = 256 + 35 * 6656;					// 233216 bytes - WOZ1
+static const size_t woz2_image_size = 1536 + 35 * 13 * 512;				// 234496 bytes - WOZ2 (13 blocks per track)
+
+// Physical sector -> logical sector (position in the DSK/PO track)
+static const int Dos_Physical_To_Logical[] = {
+		0x00,0x07,0x0E,0x06,0x0D,0x05,0x0C,0x04,0x0B,0x03,0x0A,0x02,0x09,0x01,0x08,0x0F
+};
+static const int Prodos_Physical_To_Logical[] = {
+		0x00,0x08,0x01,0x09,0x02,0x0A,0x03,0x0B,0x04,0x0C,0x05,0x0D,0x06,0x0E,0x07,0x0F
+};
+
+static void write_le16(uint8_t* dest, uint32_t value) {
+	dest[0] = value & 0xff;
+	dest[1] = (value >> 8) & 0xff;
+}
+
+static void write_le32(uint8_t* dest, uint32_t value) {
+	dest[0] = value & 0xff;
+	dest[1] = (value >> 8) & 0xff;
+	dest[2] = (value >> 16) & 0xff;
+	dest[3] = (value >> 24);
+}
+
+/*!
+	Write a full standard track (gap 1 + 16 sectors x 256 bytes).
+
+	@param dest: beginning of the track bit stream, already filled with 00
+	@param src: beginning of the track in the DSK/PO image (4096 bytes)
+	@param track_number
+	@param bProdos (00: DOS order / 01: ProDOS order)
+	@return The number of bits used by the track.
+*/
+static size_t serialise_track_standard(uint8_t* dest, const uint8_t* src, size_t track_number, bool bProdos) {
+	const int* physical_to_logical = bProdos ? Prodos_Physical_To_Logical : Dos_Physical_To_Logical;
+
+	// Sectors are written from the last to the first: serialise_sector_standard clears
+	// from the byte holding its first bit, which would erase the end of the previous sector.
+	for (size_t sector = 16; sector-- > 0;) {
+		serialise_sector_standard(dest, src + physical_to_logical[sector] * 256, 160 + sector * 3134, sector, track_number, 0);
+	}
+
+	// Write gap 1.
+	size_t track_position = 0;
+	for (size_t c = 0; c < 16; ++c) {
+		track_position = write_sync(dest, track_position);
+	}
+
+	return 160 + 16 * 3134;														// 50304 bits
+}
+
+/*!
+	Write the INFO and TMAP chunks shared by WOZ1 and WOZ2 (bytes 12 to 247).
+
+	@param woz: beginning of the WOZ image buffer, already filled with 00
+	@param version: 1 or 2
+*/
+static void write_woz_info_tmap(uint8_t* woz, uint8_t version) {
+	// INFO
+	memcpy(woz + 12, "INFO", 4);
+	write_le32(woz + 16, 60);
+	woz[20] = version;
+	woz[21] = 1;																// 5.25" disk
+	woz[22] = 0;																// not write protected
+	woz[23] = 0;																// not synchronized
+	woz[24] = 1;																// cleaned
+	memset(woz + 25, ' ', 32);													// creator
+	memcpy(woz + 25, "WriteToWoz", 10);
+	if (version == 2) {
+		woz[57] = 1;															// disk sides
+		woz[58] = 1;															// boot sector format: 16-sector
+		woz[59] = 32;															// optimal bit timing: 4us
+		write_le16(woz + 64, 13);												// largest track (blocks)
+	}
+
+	// TMAP: each track is also visible from its neighbouring quarter tracks
+	memcpy(woz + 80, "TMAP", 4);
+	write_le32(woz + 84, 160);
+	uint8_t* const tmap = woz + 88;
+	memset(tmap, 0xff, 160);
+	for (uint8_t track = 0; track < 35; track++) {
+		if (track) tmap[track * 4 - 1] = track;
+		tmap[track * 4] = track;
+		tmap[track * 4 + 1] = track;
+	}
+}
+
+/*!
+	Build a complete WOZ1 image from a DSK/PO image.
+
+	@param woz: the at-least-233216 byte WOZ image buffer
+	@param dsk: the 143360-byte DSK/PO image
+	@param bProdos (00: DOS order / 01: ProDOS order)
+	@return The size of the WOZ image.
+*/
+static size_t build_woz1(uint8_t* woz, const uint8_t* dsk, bool bProdos) {
+	memset(woz, 0, woz1_image_size);
+	memcpy(woz, "WOZ1\xff\n\r\n", 8);
+	write_woz_info_tmap(woz, 1);
+
+	// TRKS
+	memcpy(woz + 248, "TRKS", 4);
+	write_le32(woz + 252, 35 * 6656);
+	for (size_t track = 0; track < 35; track++) {
+		uint8_t* const dest = woz + 256 + (track * 6656);
+		const size_t bit_count = serialise_track_standard(dest, dsk + track * 4096, track, bProdos);
+		write_le16(dest + 6646, (uint32_t)((bit_count + 7) >> 3));				// bytes used
+		write_le16(dest + 6648, (uint32_t)bit_count);							// bit count
+		write_le16(dest + 6650, 0xffff);										// no splice point
+	}
+
+	const uint32_t crc = crc32(woz + 12, woz1_image_size - 12);
+	write_le32(woz + 8, crc);
+	return woz1_image_size;
+}
+
+/*!
+	Build a complete WOZ2 image from a DSK/PO image.
+
+	@param woz: the at-least-234496 byte WOZ image buffer
+	@param dsk: the 143360-byte DSK/PO image
+	@param bProdos (00: DOS order / 01: ProDOS order)
+	@return The size of the WOZ image.
+*/
+static size_t build_woz2(uint8_t* woz, const uint8_t* dsk, bool bProdos) {
+	memset(woz, 0, woz2_image_size);
+	memcpy(woz, "WOZ2\xff\n\r\n", 8);
+	write_woz_info_tmap(woz, 2);
+
+	// TRKS: 160 TRK entries then the bit streams, from block 3
+	memcpy(woz + 248, "TRKS", 4);
+	write_le32(woz + 252, 160 * 8 + 35 * 13 * 512);
+	for (size_t track = 0; track < 35; track++) {
+		uint8_t* const entry = woz + 256 + (track * 8);
+		const size_t bit_count = serialise_track_standard(woz + 1536 + (track * 13 * 512), dsk + track * 4096, track, bProdos);
+		write_le16(entry, (uint32_t)(3 + track * 13));							// starting block
+		write_le16(entry + 2, 13);												// block count
+		write_le32(entry + 4, (uint32_t)bit_count);								// bit count
+	}
+
+	const uint32_t crc = crc32(woz + 12, woz2_image_size - 12);
+	write_le32(woz + 8, crc);
+	return woz2_image_size;
+}
+
+// One image of the bulk conversion
+struct bulk_image {
+	std::filesystem::path input;
+	std::filesystem::path output;
+	bool bProdos;
+};
+
+// Shared state of the bulk conversion threads
+struct bulk_job {
+	std::vector<bulk_image> images;
+	uint8_t woz_version;
+	std::atomic<size_t> next_image;
+	std::atomic<size_t> nb_converted;
+
+	// read-ahead: readers fill free DSK buffers, encoders take the ready ones
+	std::vector<std::vector<uint8_t>> dsk_buffers;
+	std::vector<size_t> free_buffers;
+	std::deque<std::pair<size_t, size_t>> ready_buffers;						// (buffer, image)
+	size_t nb_readers_running;
+	std::mutex mutex;
+	std::condition_variable buffer_freed;
+	std::condition_variable buffer_ready;
+};
+
+static FILE* open_path(const std::filesystem::path& path, bool bWrite) {
+#ifdef _WIN32
+	return _wfopen(path.c_str(), bWrite ? L"wb" : L"rb");						// not limited to the ANSI code page
+#else
+	return fopen(path.c_str(), bWrite ? "wb" : "rb");
+#endif
+}
+
+static std::string lowercase(std::string text) {
+	std::transform(text.begin(), text.end(), text.begin(), [](unsigned char c) { return (char)tolower(c); });
+	return text;
+}
+
+// Key of a WOZ image name: case insensitive where the file system usually is
+static std::string output_key(const std::filesystem::path& output) {
+#if defined(_WIN32) || defined(__APPLE__)
+	return lowercase(output.lexically_normal().u8string());
+#else
+	return output.lexically_normal().u8string();
+#endif
+}
+
+static bool is_disk_image(const std::filesystem::path& path) {
+	const std::string extension = lowercase(path.extension().u8string());
+	return extension == ".dsk" || extension == ".do" || extension == ".po";
+}
+
+/*!
+	Add the images of one bulk mode path (DSK/PO image or directory) to the image list.
+	Unreadable directories are reported and skipped, the rest of the tree is kept.
+
+	@param images: the image list
+	@param input: a DSK/PO image or a directory
+	@param output_dir: directory where the WOZ images are created
+	@return The number of directories that could not be read.
+*/
+static size_t add_bulk_path(std::vector<bulk_image>& images, const std::string& input, const std::filesystem::path& output_dir) {
+	std::error_code error;
+	const std::filesystem::path path = std::filesystem::u8path(input);
+
+	// single image: written as output_dir/name.woz
+	if (!std::filesystem::is_directory(path, error)) {
+		images.push_back({ path, (output_dir / path.filename()).replace_extension(".woz"), lowercase(path.extension().u8string()) == ".po" });
+		return 0;
+	}
+
+	// directory: its tree is mirrored under output_dir/directory_name
+	std::filesystem::path directory = std::filesystem::absolute(path, error).lexically_normal();
+	if (!directory.has_filename()) directory = directory.parent_path();			// trailing separator
+	const std::filesystem::path mirror = output_dir / directory.filename();
+
+	size_t nb_failed = 0;
+	std::vector<std::filesystem::path> found;
+	std::filesystem::recursive_directory_iterator it, end;
+	std::filesystem::directory_iterator readable(path, error);						// skip_permission_denied would hide an unreadable top directory
+	if (!error) it = std::filesystem::recursive_directory_iterator(path, std::filesystem::directory_options::skip_permission_denied, error);
+	if (error) {
+		printf("ERROR: could not read directory %s\n", input.c_str());
+		return 1;
+	}
+	while (it != end) {
+		const std::filesystem::path entry = it->path();
+		if (it->is_directory(error) && !it->is_symlink(error)) {
+			// check the subdirectory can be read before entering it
+			std::filesystem::directory_iterator subdirectory(entry, error);
+			if (error) {
+				printf("ERROR: could not read directory %s\n", entry.u8string().c_str());
+				nb_failed++;
+				it.disable_recursion_pending();
+			}
+		}
+		else if (it->is_regular_file(error) && is_disk_image(entry)) {
+			found.push_back(entry);
+		}
+
+		error.clear();
+		it.increment(error);
+		if (error) {
+			printf("ERROR: could not read directory entries after %s\n", entry.u8string().c_str());
+			nb_failed++;
+			break;
+		}
+	}
+
+	std::sort(found.begin(), found.end());
+	for (const std::filesystem::path& image : found) {
+		const std::filesystem::path relative = image.lexically_relative(path);
+		images.push_back({ image, (mirror / relative).replace_extension(".woz"), lowercase(image.extension().u8string()) == ".po" });
+	}
+	return nb_failed;
+}
+
+/*!
+	Add the images of one bulk mode input to the image list.
+
+	@param images: the image list
+	@param input: a DSK/PO image, a directory or @list.txt
+	@param output_dir: directory where the WOZ images are created
+	@return The number of inputs (list file, directories) that could not be read.
+*/
+static size_t add_bulk_input(std::vector<bulk_image>& images, const std::string& input, const std::filesystem::path& output_dir) {
+	if (input[0] != '@') return add_bulk_path(images, input, output_dir);
+
+	// list of images/directories, one per line (no nested @list)
+	FILE* const list_file = open_path(std::filesystem::u8path(input.substr(1)), 0);
+	if (!list_file) {
+		printf("ERROR: could not open %s for reading\n", input.c_str() + 1);
+		return 1;
+	}
+	size_t nb_failed = 0;
+	std::string line;
+	for (int c = fgetc(list_file); ; c = fgetc(list_file)) {
+		if (c == EOF || c == '\n') {
+			while (!line.empty() && (line.back() == '\r' || line.back() == ' ')) line.pop_back();
+			if (!line.empty()) nb_failed += add_bulk_path(images, line, output_dir);
+			line.clear();
+			if (c == EOF) break;
+		}
+		else line += (char)c;
+	}
+	fclose(list_file);
+	return nb_failed;
+}
+
+/*!
+	Read a DSK/PO image.
+
+	@param input: name of the DSK/PO image
+	@param dsk: the at-least-143361 byte DSK/PO buffer
+	@return true if the file is a 143360 bytes image.
+*/
+static bool read_dsk_image(const std::filesystem::path& input, uint8_t* dsk) {
+	FILE* const dsk_file = open_path(input, 0);
+	if (!dsk_file) {
+		printf("ERROR: could not open %s for reading\n", input.u8string().c_str());
+		return false;
+	}
+	// one more byte than needed to detect bigger files
+	const size_t dsk_bytes_read = fread(dsk, 1, dsk_image_size + 1, dsk_file);
+	fclose(dsk_file);
+	if (dsk_bytes_read != dsk_image_size) {
+		printf("ERROR: %s is not a 143360 bytes DSK/PO image\n", input.u8string().c_str());
+		return false;
+	}
+	return true;
+}
+
+/*!
+	Write a WOZ image.
+
+	@param output: name of the WOZ image
+	@param woz: the WOZ image buffer
+	@param woz_size: size of the WOZ image
+	@return true on success.
+*/
+static bool write_woz_image(const std::filesystem::path& output, const uint8_t* woz, size_t woz_size) {
+	FILE* const woz_file = open_path(output, 1);
+	if (!woz_file) {
+		printf("ERROR: could not open %s for writing\n", output.u8string().c_str());
+		return false;
+	}
+	const size_t length_written = fwrite(woz, 1, woz_size, woz_file);
+	const bool bClosed = (fclose(woz_file) == 0);
+	if (length_written != woz_size || !bClosed) {
+		printf("ERROR: Could not write full WOZ image %s\n", output.u8string().c_str());
+		return false;
+	}
+	return true;
+}
+
+/*!
+	Bulk conversion reader: reads the next images ahead into free DSK
+	buffers so that encoders never wait on an input file.
+
+	@param job: the bulk conversion parameters
+*/
+static void bulk_reader(bulk_job* job) {
+	for (;;) {
+		const size_t image = job->next_image.fetch_add(1);
+		if (image >= job->images.size()) break;
+
+		size_t buffer;
+		{
+			std::unique_lock<std::mutex> lock(job->mutex);
+			job->buffer_freed.wait(lock, [job] { return !job->free_buffers.empty(); });
+			buffer = job->free_buffers.back();
+			job->free_buffers.pop_back();
+		}
+
+		const bool bRead = read_dsk_image(job->images[image].input, job->dsk_buffers[buffer].data());
+		{
+			std::lock_guard<std::mutex> lock(job->mutex);
+			if (bRead) job->ready_buffers.push_back(std::make_pair(buffer, image));
+			else job->free_buffers.push_back(buffer);
+		}
+		if (bRead) job->buffer_ready.notify_one();
+		else job->buffer_freed.notify_one();
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(job->mutex);
+		job->nb_readers_running--;
+	}
+	job->buffer_ready.notify_all();
+}
+
+/*!
+	Bulk conversion encoder: encodes the images read by the readers
+	and writes them, until every reader is done.
+
+	@param job: the bulk conversion parameters
+*/
+static void bulk_encoder(bulk_job* job) {
+	// buffer reused for every image encoded by this thread
+	std::vector<uint8_t> woz(woz2_image_size);									// large enough for WOZ1 too
+
+	for (;;) {
+		size_t buffer, image;
+		{
+			std::unique_lock<std::mutex> lock(job->mutex);
+			job->buffer_ready.wait(lock, [job] { return !job->ready_buffers.empty() || job->nb_readers_running == 0; });
+			if (job->ready_buffers.empty()) break;
+			buffer = job->ready_buffers.front().first;
+			image = job->ready_buffers.front().second;
+			job->ready_buffers.pop_front();
+		}
+
+		const uint8_t* const dsk = job->dsk_buffers[buffer].data();
+		const bool bProdos = job->images[image].bProdos;
+		const size_t woz_size = (job->woz_version == 2) ? build_woz2(woz.data(), dsk, bProdos) : build_woz1(woz.data(), dsk, bProdos);
+
+		// the DSK buffer can be refilled while the WOZ image is written
+		{
+			std::lock_guard<std::mutex> lock(job->mutex);
+			job->free_buffers.push_back(buffer);
+		}
+		job->buffer_freed.notify_one();
+
+		if (write_woz_image(job->images[image].output, woz.data(), woz_size)) {
+			job->nb_converted.fetch_add(1);
+		}
+	}
+}
+
+/*!
+	Bulk mode entry point: W2W -b 1|2 output_dir input [input ...]
+
+	@return 0 if every image was converted.
+*/
+static int bulk_convert(int argc, char* argv[]) {
+	if (argc < 5 || ((strcmp(argv[2], "1") != 0) && (strcmp(argv[2], "2") != 0))) {
+		// args#        0  1  2   3          4       5
+		printf("USAGE: W2W -b 1|2 output_dir input [input ...]\n");
+		printf("input: image.dsk|.do|.po, a directory, or @list.txt (one input per line)\n");
+		return -1;
+	}
+	const std::filesystem::path output_dir = std::filesystem::u8path(argv[3]);
+
+	// collect the images
+	std::vector<bulk_image> listed;
+	size_t nb_input_failures = 0;
+	for (int arg = 4; arg < argc; arg++) {
+		nb_input_failures += add_bulk_input(listed, argv[arg], output_dir);
+	}
+
+	// an image listed several times is converted once
+	std::vector<bulk_image> found;
+	std::map<std::filesystem::path, bool> inputs;
+	for (const bulk_image& image : listed) {
+		std::error_code error;
+		std::filesystem::path identity = std::filesystem::weakly_canonical(image.input, error);
+		if (error) identity = std::filesystem::absolute(image.input, error).lexically_normal();
+		if (inputs.insert(std::make_pair(identity, true)).second) found.push_back(image);
+	}
+
+	// reject the different images that would be written to the same WOZ image
+	std::map<std::string, size_t> nb_outputs;
+	for (const bulk_image& image : found) {
+		nb_outputs[output_key(image.output)]++;
+	}
+	bulk_job job;
+	for (const bulk_image& image : found) {
+		if (nb_outputs[output_key(image.output)] > 1) {
+			printf("ERROR: %s skipped, another input is also written to %s\n", image.input.u8string().c_str(), image.output.u8string().c_str());
+		}
+		else job.images.push_back(image);
+	}
+
+	// create the output directories
+	std::vector<std::filesystem::path> directories;
+	directories.push_back(output_dir);
+	for (const bulk_image& image : job.images) {
+		directories.push_back(image.output.parent_path());
+	}
+	std::sort(directories.begin(), directories.end());
+	directories.erase(std::unique(directories.begin(), directories.end()), directories.end());
+	for (const std::filesystem::path& directory : directories) {
+		std::error_code error;
+		std::filesystem::create_directories(directory, error);
+		if (error) {
+			printf("ERROR: could not create directory %s\n", directory.u8string().c_str());
+			return -2;
+		}
+	}
+
+	job.woz_version = (uint8_t)strtol(argv[2], NULL, 0);
+	job.next_image = 0;
+	job.nb_converted = 0;
+
+	// one encoder per core, two readers ahead of them
+	size_t nb_encoders = std::thread::hardware_concurrency();
+	if (nb_encoders == 0) nb_encoders = 1;
+	nb_encoders = std::max<size_t>(1, std::min(nb_encoders, job.images.size()));
+	const size_t nb_readers = std::max<size_t>(1, std::min<size_t>(2, job.images.size()));
+	job.nb_readers_running = nb_readers;
+	job.dsk_buffers.resize(2 * nb_encoders + nb_readers, std::vector<uint8_t>(dsk_image_size + 1));
+	for (size_t buffer = 0; buffer < job.dsk_buffers.size(); buffer++) {
+		job.free_buffers.push_back(buffer);
+	}
+
+	const auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (size_t t = 0; t < nb_readers; t++) {
+		threads.emplace_back(bulk_reader, &job);
+	}
+	for (size_t t = 0; t < nb_encoders; t++) {
+		threads.emplace_back(bulk_encoder, &job);
+	}
+	for (std::thread& thread : threads) {
+		thread.join();
+	}
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	const size_t nb_converted = job.nb_converted;
+	printf("%zu/%zu image(s) converted to WOZ%u in %.3f s (%.1f images/s, %zu encoder(s), %zu reader(s))\n",
+		nb_converted, found.size(), job.woz_version, seconds, seconds > 0 ? nb_converted / seconds : 0.0, nb_encoders, nb_readers);
+	if (nb_input_failures) {
+		printf("%zu input(s) (list file or directory) could not be read, their images are not counted above\n", nb_input_failures);
+	}
+
+	return (nb_input_failures == 0 && nb_converted == found.size()) ? 0 : -2;
+}